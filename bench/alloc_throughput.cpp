@@ -0,0 +1,128 @@
+// Compares Arena and FixedPool against malloc().
+//
+//   throughput    - every thread allocates a batch of small blocks,
+//                   touches them and frees them again.
+//   false sharing - every thread gets one counter from the allocator
+//                   and increments it. malloc() packs small blocks next
+//                   to each other, FixedPool(isolate) gives each its
+//                   own cache line.
+//
+// Build: g++ -O2 -std=c++20 -pthread -I.. alloc_throughput.cpp -o alloc_throughput
+// Usage: alloc_throughput [threads] [block_size]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../x86_arena.hpp"
+
+static constexpr int ROUNDS = 200;
+static constexpr int BATCH = 4096;
+static constexpr long INCREMENTS = 20000000;
+
+template <typename Fn>
+static double run_threads(int threads, Fn fn)
+{
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int t = 0; t < threads; t++)
+	pool.emplace_back(fn, t);
+    for (auto &t : pool)
+	t.join();
+    return std::chrono::duration<double>(
+	std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *name, double secs, double ops)
+{
+    std::printf("  %-16s %8.3f s %10.1f Mops/s\n", name, secs, ops / secs / 1e6);
+}
+
+static void bench_throughput(int threads, size_t size)
+{
+    double ops = 2.0 * threads * ROUNDS * BATCH;
+    FixedPool pool(size);
+
+    std::printf("throughput, %d threads, %zu byte blocks\n", threads, size);
+
+    report("malloc", run_threads(threads, [&](int) {
+	std::vector<void *> v(BATCH);
+	for (int r = 0; r < ROUNDS; r++) {
+	    for (auto &p : v) {
+		p = std::malloc(size);
+		std::memset(p, r, size);
+	    }
+	    for (auto p : v)
+		std::free(p);
+	}
+    }), ops);
+
+    report("FixedPool", run_threads(threads, [&](int) {
+	std::vector<void *> v(BATCH);
+	for (int r = 0; r < ROUNDS; r++) {
+	    for (auto &p : v) {
+		p = pool.allocate();
+		std::memset(p, r, size);
+	    }
+	    for (auto p : v)
+		pool.deallocate(p);
+	}
+    }), ops);
+
+    // An arena never frees single blocks, resetting it
+    // is the equivalent of freeing the whole batch.
+    report("Arena", run_threads(threads, [&](int) {
+	Arena arena;
+	for (int r = 0; r < ROUNDS; r++) {
+	    for (int i = 0; i < BATCH; i++)
+		std::memset(arena.allocate(size), r, size);
+	    arena.reset();
+	}
+    }), ops);
+}
+
+static void bench_false_sharing(int threads)
+{
+    std::vector<volatile long *> counters(threads);
+    double ops = static_cast<double>(threads) * INCREMENTS;
+    FixedPool pool(sizeof(long), true);
+    auto bump = [&](int t) {
+	volatile long *c = counters[t];
+	for (long i = 0; i < INCREMENTS; i++)
+	    *c = *c + 1;
+    };
+
+    std::printf("false sharing, %d threads, line size %u\n",
+		threads, CacheGeometry::get().line_size);
+
+    for (auto &c : counters)
+	c = static_cast<volatile long *>(std::malloc(sizeof(long)));
+    report("malloc", run_threads(threads, bump), ops);
+    for (auto c : counters)
+	std::free(const_cast<long *>(c));
+
+    for (auto &c : counters)
+	c = static_cast<volatile long *>(pool.allocate());
+    report("FixedPool", run_threads(threads, bump), ops);
+    for (auto c : counters)
+	pool.deallocate(const_cast<long *>(c));
+}
+
+int main(int argc, char **argv)
+{
+    int threads = argc > 1 ? std::atoi(argv[1]) :
+	static_cast<int>(std::thread::hardware_concurrency());
+    size_t size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 32;
+    const CacheGeometry &geo = CacheGeometry::get();
+
+    if (threads < 1)
+	threads = 1;
+    std::printf("line %u, l1d %lu, l2 %lu, l3 %lu\n",
+		geo.line_size, geo.l1d_size, geo.l2_size, geo.l3_size);
+    bench_throughput(threads, size);
+    bench_false_sharing(threads);
+    return (0);
+}
@@ -0,0 +1,79 @@
+// Cost of locking and unlocking a GuardedArena, with a protection key
+// (WRPKRU) and with mprotect(). Every toggle is followed by a write to
+// the arena so the new rights are actually in effect.
+//
+// mprotect() gets more expensive the more CPUs are running threads of
+// the process, since it has to shoot down their TLB entries. Pass a
+// number of busy threads to see that.
+//
+// Build: g++ -O2 -std=c++20 -pthread -I.. pkey_toggle.cpp -o pkey_toggle
+// Usage: pkey_toggle [toggles] [busy_threads] [pages]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../x86_guard.hpp"
+
+static double bench(GuardedArena &arena, size_t pages, unsigned int toggles)
+{
+    char *p = static_cast<char *>(arena.allocate(pages * Slab::SMALL_PAGE,
+						 Slab::SMALL_PAGE));
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < toggles; i++) {
+	arena.unlock();
+	p[(i % pages) * Slab::SMALL_PAGE] = static_cast<char>(i);
+	arena.lock();
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(
+	std::chrono::steady_clock::now() - start).count();
+    arena.unlock();
+    // Two toggles per iteration.
+    return (ns / toggles / 2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int toggles = argc > 1 ? std::atoi(argv[1]) : 100000;
+    int busy = argc > 2 ? std::atoi(argv[2]) : 0;
+    size_t pages = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 16;
+    const IsX86Feat feat;
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+
+    if (pages == 0)
+	pages = 1;
+    std::printf("pku: %s, ospke: %s, toggles: %u, busy threads: %d, pages: %zu\n",
+		feat.has(Feature::PKU) ? "yes" : "no",
+		feat.has(Feature::OSPKE) ? "yes" : "no",
+		toggles, busy, pages);
+
+    for (int i = 0; i < busy; i++)
+	threads.emplace_back([&] {
+	    while (!stop.load(std::memory_order_relaxed))
+		;
+	});
+
+    {
+	GuardedArena arena(pages * Slab::SMALL_PAGE * 2);
+	if (arena.uses_pkey())
+	    std::printf("  %-10s %10.1f ns/toggle\n", "pkey",
+			bench(arena, pages, toggles));
+	else
+	    std::printf("  %-10s skipped\n", "pkey");
+    }
+    {
+	GuardedArena arena(pages * Slab::SMALL_PAGE * 2, true);
+	std::printf("  %-10s %10.1f ns/toggle\n", "mprotect",
+		    bench(arena, pages, toggles));
+    }
+
+    stop.store(true);
+    for (auto &t : threads)
+	t.join();
+    return (0);
+}
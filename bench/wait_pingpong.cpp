@@ -0,0 +1,130 @@
+// Ping-pong between two threads pinned to different cores, for each
+// wait mode of WaitWord. Reports the one-way wake latency and the CPU
+// time both threads used per round trip.
+//
+// Build: g++ -O2 -std=c++20 -pthread -I.. wait_pingpong.cpp -o wait_pingpong
+// Usage: wait_pingpong [rounds] [delay_us] [cpu_a] [cpu_b]
+//
+// A delay of a few tens of microseconds pushes PAUSE past its spin budget
+// and into the futex, which is where it differs the most from UMWAIT.
+// Keep in mind that UMWAIT still shows up as busy CPU time in getrusage(),
+// the savings are power and the issue slots handed to the SMT sibling.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "../x86_wait.hpp"
+
+struct Result {
+    double latency_ns;
+    double cpu_percent;
+};
+
+static void pin_to(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+	std::fprintf(stderr, "warning: can't pin to CPU %d\n", cpu);
+}
+
+static double thread_cpu_us()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+	ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void delay(unsigned int us)
+{
+    auto until = std::chrono::steady_clock::now() +
+	std::chrono::microseconds(us);
+
+    while (std::chrono::steady_clock::now() < until)
+	;
+}
+
+static Result run(WaitMode mode, unsigned int rounds, unsigned int delay_us,
+		  int cpu_a, int cpu_b)
+{
+    WaitWord ping(0, mode), pong(0, mode);
+    double pong_cpu = 0;
+
+    std::thread peer([&] {
+	pin_to(cpu_b);
+	double start = thread_cpu_us();
+	for (uint32_t i = 0; i < rounds; i++) {
+	    ping.wait(i);
+	    pong.store(i + 1);
+	    pong.notify_one();
+	}
+	pong_cpu = thread_cpu_us() - start;
+    });
+
+    pin_to(cpu_a);
+    double start_cpu = thread_cpu_us();
+    double waited = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < rounds; i++) {
+	// The delay is the time the peer is idle; don't count it
+	// towards the latency.
+	auto t0 = std::chrono::steady_clock::now();
+	delay(delay_us);
+	waited += std::chrono::duration<double, std::nano>(
+	    std::chrono::steady_clock::now() - t0).count();
+	ping.store(i + 1);
+	ping.notify_one();
+	pong.wait(i);
+    }
+
+    double total = std::chrono::duration<double, std::nano>(
+	std::chrono::steady_clock::now() - start).count();
+    double ping_cpu = thread_cpu_us() - start_cpu;
+    peer.join();
+
+    // Subtract the busy delay from the pinger, it's not waiting time.
+    ping_cpu -= waited / 1e3;
+    return {
+	(total - waited) / rounds / 2,
+	(ping_cpu + pong_cpu) / (total / 1e3) * 100,
+    };
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int rounds = argc > 1 ? std::atoi(argv[1]) : 100000;
+    unsigned int delay_us = argc > 2 ? std::atoi(argv[2]) : 0;
+    int cpu_a = argc > 3 ? std::atoi(argv[3]) : 0;
+    int cpu_b = argc > 4 ? std::atoi(argv[4]) : 1;
+    const struct {
+	WaitMode mode;
+	const char *name;
+    } modes[] = {
+	{ WaitMode::UMWAIT, "umwait" },
+	{ WaitMode::PAUSE, "pause" },
+	{ WaitMode::FUTEX, "futex" },
+    };
+
+    std::printf("waitpkg: %s, pause: %u ticks, rounds: %u, delay: %u us\n",
+		WaitCalibration::get().has_waitpkg ? "yes" : "no",
+		WaitCalibration::get().pause_ticks, rounds, delay_us);
+    for (const auto &m : modes) {
+	if (m.mode == WaitMode::UMWAIT && !WaitCalibration::get().has_waitpkg) {
+	    std::printf("%-8s skipped\n", m.name);
+	    continue;
+	}
+	Result r = run(m.mode, rounds, delay_us, cpu_a, cpu_b);
+	std::printf("%-8s %10.1f ns/wake %8.1f %% cpu (of 2 threads)\n",
+		    m.name, r.latency_ns, r.cpu_percent);
+    }
+    return (0);
+}
@@ -16,6 +16,13 @@
 			: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)	\
 			: "0"(level));					\
 	} while (0)
+#   define __cpuid_count(level, count, eax, ebx, ecx, edx)		\
+	do {								\
+		__asm__ volatile (					\
+			"cpuid\n\t"					\
+			: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)	\
+			: "0"(level), "2"(count));			\
+	} while (0)
 #  elif defined (__x86_64__)
 #   define __cpuid(level, eax, ebx, ecx, edx)				\
 	do {								\
@@ -26,6 +33,15 @@
 			: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)	\
 			: "0"(level));					\
 	} while (0)
+#   define __cpuid_count(level, count, eax, ebx, ecx, edx)		\
+	do {								\
+		__asm__ volatile (					\
+			"xchgq %%rbx, %q1\n\t"				\
+			"cpuid\n\t"					\
+			"xchgq %%rbx, %q1\n\t"				\
+			: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)	\
+			: "0"(level), "2"(count));			\
+	} while (0)
 #  else
 #   error only for x86 and x86-64.
 #  endif
@@ -197,8 +213,9 @@ public:
 		regs[IDX0].ecx, regs[IDX0].edx);
 	__cpuid(6, regs[IDX1].eax, regs[IDX1].ebx,
 		regs[IDX1].ecx, regs[IDX1].edx);
-	__cpuid(7, regs[IDX2].eax, regs[IDX2].ebx,
-		regs[IDX2].ecx, regs[IDX2].edx);
+	// Leaf 7 has subleaves, the extended features are in ECX = 0.
+	__cpuid_count(7, 0, regs[IDX2].eax, regs[IDX2].ebx,
+		      regs[IDX2].ecx, regs[IDX2].edx);
     }
 
     inline bool is_vendor_intel() const {
@@ -213,6 +230,14 @@ public:
 	return (!is_vendor_intel());
     }
 
+    // Line size used by CLFLUSH, in bytes. It's reported in
+    // EBX[15:8] of leaf 1 in units of 8 bytes, only valid with CLFSH.
+    inline unsigned int clflush_line_size() const {
+	if (!has(Feature::CLFSH))
+	    return 0;
+	return (((regs[IDX0].ebx >> 8) & 0xff) * 8);
+    }
+
     inline bool has(Feature type) const {
 	switch (type) {
 	case Feature::FPU:    return check(regs[IDX0].edx, 0);
@@ -355,4 +380,96 @@ public:
     }
 };
 
+// Data cache sizes and line size, in bytes. A zero size
+// means the level isn't present or couldn't be detected.
+struct CacheGeometry {
+    unsigned int line_size;
+    unsigned long l1d_size;
+    unsigned long l2_size;
+    unsigned long l3_size;
+
+private:
+    // Leaf 4 on Intel and 0x8000001D on AMD share the same layout.
+    void from_deterministic_leaf(unsigned int leaf) {
+	unsigned int eax, ebx, ecx, edx;
+
+	for (unsigned int i = 0; i < 16; i++) {
+	    __cpuid_count(leaf, i, eax, ebx, ecx, edx);
+
+	    unsigned int type = eax & 0x1f;
+	    unsigned int level = (eax >> 5) & 0x7;
+	    if (type == 0)
+		break;
+	    // Skip instruction caches.
+	    if (type == 2)
+		continue;
+
+	    unsigned long ways = ((ebx >> 22) & 0x3ff) + 1;
+	    unsigned long parts = ((ebx >> 12) & 0x3ff) + 1;
+	    unsigned long line = (ebx & 0xfff) + 1;
+	    unsigned long sets = static_cast<unsigned long>(ecx) + 1;
+	    unsigned long size = ways * parts * line * sets;
+
+	    switch (level) {
+	    case 1: l1d_size = size; break;
+	    case 2: l2_size = size; break;
+	    case 3: l3_size = size; break;
+	    default: break;
+	    }
+	    if (level == 1 && line_size == 0)
+		line_size = static_cast<unsigned int>(line);
+	}
+    }
+
+    // Older AMD CPUs without TOPOEXT only have the legacy leaves.
+    void from_amd_legacy_leaves(unsigned int max_ext) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (max_ext >= 0x80000005) {
+	    __cpuid(0x80000005, eax, ebx, ecx, edx);
+	    l1d_size = ((ecx >> 24) & 0xff) * 1024UL;
+	    if (line_size == 0)
+		line_size = ecx & 0xff;
+	}
+	if (max_ext >= 0x80000006) {
+	    __cpuid(0x80000006, eax, ebx, ecx, edx);
+	    l2_size = ((ecx >> 16) & 0xffff) * 1024UL;
+	    l3_size = ((edx >> 18) & 0x3fff) * 512UL * 1024UL;
+	}
+    }
+public:
+    CacheGeometry() : line_size(0), l1d_size(0), l2_size(0), l3_size(0) {
+	const IsX86Feat feat;
+	unsigned int max_leaf, max_ext, eax, ebx, ecx, edx;
+
+	__cpuid(0, max_leaf, ebx, ecx, edx);
+	__cpuid(0x80000000, max_ext, ebx, ecx, edx);
+
+	line_size = feat.clflush_line_size();
+	if (feat.is_vendor_intel()) {
+	    if (max_leaf >= 4)
+		from_deterministic_leaf(4);
+	} else {
+	    bool topoext = false;
+
+	    if (max_ext >= 0x80000001) {
+		__cpuid(0x80000001, eax, ebx, ecx, edx);
+		topoext = (ecx & (1 << 22)) != 0;
+	    }
+	    if (topoext && max_ext >= 0x8000001d)
+		from_deterministic_leaf(0x8000001d);
+	    else
+		from_amd_legacy_leaves(max_ext);
+	}
+	// Every x86-64 CPU so far uses 64-byte lines.
+	if (line_size == 0)
+	    line_size = 64;
+    }
+
+    static const CacheGeometry &get() {
+	static const CacheGeometry geometry;
+	return geometry;
+    }
+};
+
 #endif
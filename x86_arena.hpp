@@ -0,0 +1,449 @@
+#ifndef X86_ARENA_HPP
+# define X86_ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+
+#include "is_x86_feat.hpp"
+
+// Page-granular memory straight from mmap(). Slabs that are a multiple
+// of the huge page size are backed by hugetlbfs pages if the host has
+// some reserved, otherwise they are aligned and madvise()d so that
+// transparent huge pages can kick in where they are enabled.
+struct Slab {
+    static constexpr size_t SMALL_PAGE = 4096;
+    static constexpr size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+    static inline size_t round_up(size_t size, size_t align) {
+	return ((size + align - 1) & ~(align - 1));
+    }
+
+    // Returns nullptr on failure, or if size is 0.
+    static void *map(size_t size) {
+	void *p;
+
+	if (size == 0)
+	    return (nullptr);
+	if (size % HUGE_PAGE != 0) {
+	    p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    return (p == MAP_FAILED ? nullptr : p);
+	}
+
+#if defined(MAP_HUGETLB)
+	p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+	    return (p);
+#endif
+
+	// Over-allocate to get a huge page aligned range, then
+	// give the unaligned head and tail back.
+	size_t len = size + HUGE_PAGE;
+	char *raw = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
+					     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (raw == MAP_FAILED)
+	    return (nullptr);
+
+	char *aligned = reinterpret_cast<char *>(
+	    round_up(reinterpret_cast<uintptr_t>(raw), HUGE_PAGE));
+	if (aligned != raw)
+	    munmap(raw, aligned - raw);
+	if (aligned + size != raw + len)
+	    munmap(aligned + size, (raw + len) - (aligned + size));
+#if defined(MADV_HUGEPAGE)
+	// Fails with EINVAL when THP is disabled, which is fine.
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return (aligned);
+    }
+
+    static void unmap(void *p, size_t size) {
+	munmap(p, size);
+    }
+
+    // Carves size bytes aligned to align (a power of two) out of
+    // [cur, end). Returns nullptr if they don't fit, cur is only
+    // moved on success.
+    static inline void *bump(char *&cur, char *end, size_t size, size_t align) {
+	if (cur == nullptr)
+	    return (nullptr);
+
+	uintptr_t p = round_up(reinterpret_cast<uintptr_t>(cur), align);
+	uintptr_t e = reinterpret_cast<uintptr_t>(end);
+	if (p > e || size > e - p)
+	    return (nullptr);
+	cur = reinterpret_cast<char *>(p + size);
+	return (reinterpret_cast<void *>(p));
+    }
+};
+
+// Bump allocator for short-lived, single-threaded allocations such as
+// everything belonging to one request. Memory is only given back by
+// reset() or the destructor.
+//
+// Chunks start at the size of L1d and double up to the size of L2 (or
+// a huge page, whichever is larger), so small arenas stay hot in cache
+// and big ones don't go back to mmap() all the time.
+struct Arena {
+private:
+    struct Chunk {
+	Chunk *next;
+	size_t size;
+    };
+
+    Chunk *head;
+    char *cur;
+    char *end;
+    size_t line_size;
+    size_t next_size;
+    size_t max_size;
+
+    bool grow(size_t need) {
+	// The header gets a line of its own so the first
+	// allocation doesn't share it.
+	size_t header = Slab::round_up(sizeof(Chunk), line_size);
+	size_t size = next_size;
+
+	// Keeps the doubling below from overflowing.
+	if (need > std::numeric_limits<size_t>::max() / 4)
+	    return (false);
+	while (size < need + header)
+	    size *= 2;
+	if (size >= Slab::HUGE_PAGE)
+	    size = Slab::round_up(size, Slab::HUGE_PAGE);
+
+	void *p = Slab::map(size);
+	if (p == nullptr)
+	    return (false);
+
+	Chunk *chunk = static_cast<Chunk *>(p);
+	chunk->next = head;
+	chunk->size = size;
+	head = chunk;
+	cur = static_cast<char *>(p) + header;
+	end = static_cast<char *>(p) + size;
+	next_size = next_size * 2 < max_size ? next_size * 2 : max_size;
+	return (true);
+    }
+public:
+    Arena() : head(nullptr), cur(nullptr), end(nullptr) {
+	const CacheGeometry &geo = CacheGeometry::get();
+
+	line_size = geo.line_size;
+	next_size = Slab::round_up(geo.l1d_size ? geo.l1d_size : 32 * 1024,
+				   Slab::SMALL_PAGE);
+	max_size = geo.l2_size > Slab::HUGE_PAGE ?
+	    Slab::round_up(geo.l2_size, Slab::HUGE_PAGE) :
+	    Slab::HUGE_PAGE;
+    }
+
+    ~Arena() {
+	release(nullptr);
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    inline size_t cache_line_size() const {
+	return line_size;
+    }
+
+    // align has to be a power of two. Throws std::bad_alloc.
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+	void *p = Slab::bump(cur, end, size, align);
+
+	if (p == nullptr) {
+	    if (size > std::numeric_limits<size_t>::max() - align ||
+		!grow(size + align))
+		throw std::bad_alloc();
+	    p = Slab::bump(cur, end, size, align);
+	}
+	return (p);
+    }
+
+    // Line aligned and padded to whole lines, so that data written by
+    // different threads never ends up in the same line.
+    inline void *allocate_line(size_t size) {
+	if (size > std::numeric_limits<size_t>::max() - line_size)
+	    throw std::bad_alloc();
+	return allocate(Slab::round_up(size, line_size), line_size);
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args) {
+	return new (allocate(sizeof(T), alignof(T)))
+	    T(std::forward<Args>(args)...);
+    }
+
+    // Drop everything but the largest chunk. That's usually the newest
+    // one, unless an oversized allocation got a chunk of its own.
+    void reset() {
+	Chunk *keep = head;
+
+	if (head == nullptr)
+	    return;
+	for (Chunk *c = head->next; c; c = c->next)
+	    if (c->size > keep->size)
+		keep = c;
+	release(keep);
+	head = keep;
+	head->next = nullptr;
+	cur = reinterpret_cast<char *>(head) +
+	    Slab::round_up(sizeof(Chunk), line_size);
+	end = reinterpret_cast<char *>(head) + head->size;
+    }
+private:
+    void release(Chunk *keep) {
+	Chunk *c = head;
+
+	while (c) {
+	    Chunk *next = c->next;
+	    if (c != keep)
+		Slab::unmap(c, c->size);
+	    c = next;
+	}
+	if (keep == nullptr)
+	    head = nullptr;
+    }
+};
+
+// Small per-thread index, so per-thread data can live in plain arrays
+// instead of a map keyed by thread. Slots of exited threads are reused.
+struct ThreadSlot {
+    static constexpr int MAX_SLOTS = 256;
+
+    // Returns -1 once more than MAX_SLOTS threads are alive.
+    static int id() {
+	thread_local Holder holder;
+	return holder.slot;
+    }
+private:
+    struct Registry {
+	std::mutex lock;
+	std::vector<int> unused;
+	int next = 0;
+    };
+
+    // Never freed, thread_local destructors may run after
+    // static ones on some exit paths.
+    static Registry &registry() {
+	static Registry *r = new Registry;
+	return *r;
+    }
+
+    struct Holder {
+	int slot;
+
+	Holder() {
+	    Registry &r = registry();
+	    std::lock_guard<std::mutex> guard(r.lock);
+
+	    if (!r.unused.empty()) {
+		slot = r.unused.back();
+		r.unused.pop_back();
+	    } else {
+		slot = r.next < MAX_SLOTS ? r.next++ : -1;
+	    }
+	}
+
+	~Holder() {
+	    if (slot < 0)
+		return;
+	    Registry &r = registry();
+	    std::lock_guard<std::mutex> guard(r.lock);
+	    r.unused.push_back(slot);
+	    // A later thread_local destructor on this thread may still
+	    // use a pool; it has to take the locked path now, the slot
+	    // may already belong to a new thread.
+	    slot = -1;
+	}
+    };
+};
+
+// Thread-safe allocator for blocks of one size. Every thread has its
+// own free list, so allocate() and deallocate() don't take a lock
+// unless the list runs dry or grows too long; then a batch of blocks
+// moves between it and the shared list. The batch is sized to about a
+// quarter of L1d. Blocks freed on another thread stay with that thread.
+//
+// With isolate, blocks are line aligned and padded to whole lines
+// to rule out false sharing between their owners.
+struct FixedPool {
+private:
+    struct Node {
+	Node *next;
+    };
+
+    struct LocalCache {
+	Node *head;
+	size_t count;
+    };
+
+    struct SlabRef {
+	void *p;
+	size_t size;
+    };
+
+    size_t block;
+    size_t batch;
+    size_t slab_size;
+    size_t cache_stride;
+    char *caches;
+
+    std::mutex lock;
+    Node *shared;
+    char *cur;
+    char *end;
+    std::vector<SlabRef> slabs;
+
+    inline LocalCache *cache(int slot) const {
+	return reinterpret_cast<LocalCache *>(caches + slot * cache_stride);
+    }
+
+    // Called with the lock held.
+    Node *carve() {
+	if (cur == nullptr || block > static_cast<size_t>(end - cur)) {
+	    void *p = Slab::map(slab_size);
+	    if (p == nullptr)
+		return (nullptr);
+	    if (block > slab_size) {
+		Slab::unmap(p, slab_size);
+		return (nullptr);
+	    }
+	    slabs.push_back({ p, slab_size });
+	    cur = static_cast<char *>(p);
+	    end = cur + slab_size;
+	}
+	Node *n = reinterpret_cast<Node *>(cur);
+	cur += block;
+	return (n);
+    }
+
+    bool refill(LocalCache *c) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	while (c->count < batch) {
+	    Node *n = shared;
+	    if (n) {
+		shared = n->next;
+	    } else if ((n = carve()) == nullptr) {
+		break;
+	    }
+	    n->next = c->head;
+	    c->head = n;
+	    c->count++;
+	}
+	return (c->head != nullptr);
+    }
+
+    void spill(LocalCache *c) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (size_t i = 0; i < batch && c->head; i++) {
+	    Node *n = c->head;
+	    c->head = n->next;
+	    c->count--;
+	    n->next = shared;
+	    shared = n;
+	}
+    }
+public:
+    // Throws std::bad_alloc if size is too large to fit in a slab.
+    explicit FixedPool(size_t size, bool isolate = false)
+	: caches(nullptr), shared(nullptr), cur(nullptr), end(nullptr) {
+	const CacheGeometry &geo = CacheGeometry::get();
+	const size_t max = std::numeric_limits<size_t>::max();
+	size_t l1d = geo.l1d_size ? geo.l1d_size : 32 * 1024;
+	size_t align = isolate ? geo.line_size : alignof(std::max_align_t);
+
+	block = size < sizeof(Node) ? sizeof(Node) : size;
+	if (block > max - align)
+	    throw std::bad_alloc();
+	block = Slab::round_up(block, align);
+
+	batch = l1d / 4 / block;
+	if (batch < 8)
+	    batch = 8;
+	else if (batch > 256)
+	    batch = 256;
+
+	if (block > (max - Slab::HUGE_PAGE) / (batch * 8))
+	    throw std::bad_alloc();
+	slab_size = Slab::round_up(block * batch * 8, Slab::HUGE_PAGE);
+
+	// One line (at least) per thread, the caches are written
+	// all the time by their owners.
+	cache_stride = Slab::round_up(sizeof(LocalCache), geo.line_size);
+	caches = static_cast<char *>(
+	    Slab::map(Slab::round_up(cache_stride * ThreadSlot::MAX_SLOTS,
+				     Slab::SMALL_PAGE)));
+	if (caches == nullptr)
+	    throw std::bad_alloc();
+	// mmap() gives zeroed memory, all caches start empty.
+    }
+
+    ~FixedPool() {
+	for (const SlabRef &s : slabs)
+	    Slab::unmap(s.p, s.size);
+	Slab::unmap(caches, Slab::round_up(cache_stride * ThreadSlot::MAX_SLOTS,
+					   Slab::SMALL_PAGE));
+    }
+
+    FixedPool(const FixedPool &) = delete;
+    FixedPool &operator=(const FixedPool &) = delete;
+
+    inline size_t block_size() const {
+	return block;
+    }
+
+    // Throws std::bad_alloc.
+    void *allocate() {
+	int slot = ThreadSlot::id();
+
+	if (slot < 0) {
+	    std::lock_guard<std::mutex> guard(lock);
+	    Node *n = shared;
+	    if (n) {
+		shared = n->next;
+	    } else if ((n = carve()) == nullptr) {
+		throw std::bad_alloc();
+	    }
+	    return (n);
+	}
+
+	LocalCache *c = cache(slot);
+	if (c->head == nullptr && !refill(c))
+	    throw std::bad_alloc();
+	Node *n = c->head;
+	c->head = n->next;
+	c->count--;
+	return (n);
+    }
+
+    void deallocate(void *p) {
+	int slot = ThreadSlot::id();
+	Node *n = static_cast<Node *>(p);
+
+	if (slot < 0) {
+	    std::lock_guard<std::mutex> guard(lock);
+	    n->next = shared;
+	    shared = n;
+	    return;
+	}
+
+	LocalCache *c = cache(slot);
+	n->next = c->head;
+	c->head = n;
+	if (++c->count > batch * 2)
+	    spill(c);
+    }
+};
+
+#endif
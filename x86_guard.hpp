@@ -0,0 +1,225 @@
+#ifndef X86_GUARD_HPP
+# define X86_GUARD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+#include "is_x86_feat.hpp"
+#include "x86_arena.hpp"
+
+enum class GuardAccess {
+    NONE,
+    READ,
+    READ_WRITE,
+};
+
+// Bump allocator for sensitive data whose pages can be locked and
+// unlocked cheaply.
+//
+// With PKU and OSPKE, all chunks are tagged with one protection key and
+// set_access() is a WRPKRU, a few dozen cycles with no syscall and no
+// TLB shootdown. Otherwise it falls back to mprotect() on every chunk.
+//
+// The two paths differ in scope. PKRU is a per-thread register, so with
+// a key the access rights only change for the calling thread. Only the
+// thread that created the arena starts out with access. Threads that
+// already existed keep Linux's default PKRU, which denies access to every
+// new key, so they see NONE until they call unlock() themselves. Threads
+// created later copy the rights their creator had at that moment.
+// mprotect() changes the rights for every thread in the process, and they
+// all start with read-write. Code that has to work on both should lock
+// and unlock from the thread doing the access.
+struct GuardedArena {
+private:
+    struct Chunk {
+	char *p;
+	size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    char *cur;
+    char *end;
+    size_t chunk_size;
+    int key;
+    // Only tracked for mprotect(), PKRU is read back instead.
+    GuardAccess prot_access;
+
+    static inline unsigned int rdpkru() {
+	unsigned int eax, edx;
+
+	__asm__ volatile ("rdpkru" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (eax);
+    }
+
+    static inline void wrpkru(unsigned int pkru) {
+	__asm__ volatile ("wrpkru"
+			  : : "a"(pkru), "c"(0), "d"(0) : "memory");
+    }
+
+    static int to_prot(GuardAccess access) {
+	switch (access) {
+	case GuardAccess::NONE: return PROT_NONE;
+	case GuardAccess::READ: return PROT_READ;
+	case GuardAccess::READ_WRITE: return PROT_READ | PROT_WRITE;
+	default: __builtin_abort();
+	}
+    }
+
+    // PKRU has two bits per key: AD (access disable) and WD (write disable).
+    static unsigned int to_pkru_bits(GuardAccess access) {
+	switch (access) {
+	case GuardAccess::NONE: return 0x1;
+	case GuardAccess::READ: return 0x2;
+	case GuardAccess::READ_WRITE: return 0x0;
+	default: __builtin_abort();
+	}
+    }
+
+    bool grow(size_t need) {
+	size_t size = chunk_size;
+
+	if (need > std::numeric_limits<size_t>::max() - Slab::SMALL_PAGE)
+	    return (false);
+	if (size < need)
+	    size = Slab::round_up(need, Slab::SMALL_PAGE);
+
+	char *p = static_cast<char *>(Slab::map(size));
+	if (p == nullptr)
+	    return (false);
+
+	// A new chunk has to follow the current rights. With a key the
+	// rights live in PKRU, so the pages themselves stay read-write.
+	int rc = key >= 0 ?
+	    pkey_mprotect(p, size, PROT_READ | PROT_WRITE, key) :
+	    mprotect(p, size, to_prot(prot_access));
+	if (rc != 0) {
+	    Slab::unmap(p, size);
+	    return (false);
+	}
+
+	chunks.push_back({ p, size });
+	cur = p;
+	end = p + size;
+	return (true);
+    }
+public:
+    // chunk is rounded up to whole pages, protection works per page.
+    // With force_mprotect the PKU path isn't tried, mostly for
+    // benchmarking the two against each other.
+    explicit GuardedArena(size_t chunk = 64 * 1024, bool force_mprotect = false)
+	: cur(nullptr), end(nullptr), key(-1),
+	  prot_access(GuardAccess::READ_WRITE) {
+	const IsX86Feat feat;
+
+	chunk_size = Slab::round_up(chunk ? chunk : Slab::SMALL_PAGE,
+				    Slab::SMALL_PAGE);
+	// Both come from CPUID leaf 7, subleaf 0. OSPKE tells if the OS
+	// has set CR4.PKE, PKU alone isn't enough.
+	// pkey_alloc() can still fail when the keys are used up, or the
+	// kernel was built without support.
+	if (!force_mprotect && feat.has(Feature::PKU) && feat.has(Feature::OSPKE))
+	    key = pkey_alloc(0, 0);
+    }
+
+    ~GuardedArena() {
+	for (const Chunk &c : chunks)
+	    Slab::unmap(c.p, c.size);
+	if (key >= 0) {
+	    // Leave the key open in this thread, a later pkey_alloc()
+	    // may hand it out again.
+	    set_access(GuardAccess::READ_WRITE);
+	    pkey_free(key);
+	}
+    }
+
+    GuardedArena(const GuardedArena &) = delete;
+    GuardedArena &operator=(const GuardedArena &) = delete;
+
+    inline bool uses_pkey() const {
+	return (key >= 0);
+    }
+
+    inline int pkey() const {
+	return key;
+    }
+
+    // The memory has to be writable by the caller before use, the
+    // arena itself never touches it. Throws std::bad_alloc.
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+	void *p = Slab::bump(cur, end, size, align);
+
+	if (p == nullptr) {
+	    if (size > std::numeric_limits<size_t>::max() - align ||
+		!grow(size + align))
+		throw std::bad_alloc();
+	    p = Slab::bump(cur, end, size, align);
+	}
+	return (p);
+    }
+
+    // Access rights of the calling thread.
+    GuardAccess access() const {
+	if (key < 0)
+	    return prot_access;
+
+	unsigned int bits = (rdpkru() >> (2 * key)) & 0x3;
+	if (bits & 0x1)
+	    return GuardAccess::NONE;
+	return (bits & 0x2) ? GuardAccess::READ : GuardAccess::READ_WRITE;
+    }
+
+    // Returns false if mprotect() failed, in which case the
+    // rights may be mixed between chunks.
+    bool set_access(GuardAccess access) {
+	if (key >= 0) {
+	    unsigned int pkru = rdpkru();
+
+	    pkru &= ~(0x3u << (2 * key));
+	    pkru |= to_pkru_bits(access) << (2 * key);
+	    wrpkru(pkru);
+	    return (true);
+	}
+
+	bool ok = true;
+	for (const Chunk &c : chunks)
+	    if (mprotect(c.p, c.size, to_prot(access)) != 0)
+		ok = false;
+	prot_access = access;
+	return (ok);
+    }
+
+    inline bool lock() {
+	return set_access(GuardAccess::NONE);
+    }
+
+    inline bool unlock() {
+	return set_access(GuardAccess::READ_WRITE);
+    }
+};
+
+// Opens a GuardedArena for the lifetime of the scope and
+// puts the previous rights back afterwards.
+struct GuardScope {
+private:
+    GuardedArena &arena;
+    GuardAccess saved;
+public:
+    explicit GuardScope(GuardedArena &arena,
+			GuardAccess access = GuardAccess::READ_WRITE)
+	: arena(arena), saved(arena.access()) {
+	arena.set_access(access);
+    }
+
+    ~GuardScope() {
+	arena.set_access(saved);
+    }
+
+    GuardScope(const GuardScope &) = delete;
+    GuardScope &operator=(const GuardScope &) = delete;
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef X86_WAIT_HPP
+# define X86_WAIT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <x86intrin.h>
+
+// The blocking phase needs futex(2), there is no fallback
+// that doesn't end up spinning forever.
+#if !defined(__linux__)
+# error x86_wait.hpp is only for Linux.
+#endif
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "is_x86_feat.hpp"
+
+// How a waiter spends its time before the value changes.
+//   AUTO   - UMWAIT if WAITPKG is present, otherwise PAUSE.
+//   UMWAIT - UMONITOR/UMWAIT on the word, then sleep on a futex.
+//   PAUSE  - exponential PAUSE backoff, then sleep on a futex.
+//   FUTEX  - sleep on a futex straight away.
+enum class WaitMode {
+    AUTO,
+    UMWAIT,
+    PAUSE,
+    FUTEX,
+};
+
+// Per-process timings, measured once. All values are in TSC ticks.
+struct WaitCalibration {
+    bool has_waitpkg;
+    // Rough cost of one PAUSE. It's ~10 ticks before Skylake and
+    // ~140 after, so a fixed spin count would be way off on one of them.
+    unsigned int pause_ticks;
+    // Upper bound of a single backoff step, in PAUSE instructions.
+    unsigned int max_pauses;
+
+    // How long to stay in user space before falling back to the futex.
+    // UMWAIT keeps the core in C0.1 and leaves the pipeline to the SMT
+    // sibling, so it can afford to wait a lot longer than PAUSE.
+    static constexpr uint64_t UMWAIT_BUDGET = 200000;
+    static constexpr uint64_t PAUSE_BUDGET = 20000;
+    // Deadline of a single UMWAIT. The OS may cap it further
+    // through IA32_UMWAIT_CONTROL.
+    static constexpr uint64_t UMWAIT_SLICE = 10000;
+    static constexpr uint64_t PAUSE_STEP = 1000;
+
+    WaitCalibration() {
+	const IsX86Feat feat;
+	uint64_t start, ticks;
+
+	has_waitpkg = feat.has(Feature::WAITPKG);
+
+	start = __rdtsc();
+	for (int i = 0; i < 64; i++)
+	    _mm_pause();
+	ticks = (__rdtsc() - start) / 64;
+
+	pause_ticks = ticks ? static_cast<unsigned int>(ticks) : 1;
+	max_pauses = static_cast<unsigned int>(PAUSE_STEP / pause_ticks);
+	if (max_pauses == 0)
+	    max_pauses = 1;
+    }
+
+    static const WaitCalibration &get() {
+	static const WaitCalibration calibration;
+	return calibration;
+    }
+};
+
+// A 32-bit word that threads can block on until it changes, similar to
+// C++20 std::atomic<T>::wait() but with a low latency spinning phase.
+// The writer has to call notify_one() or notify_all() after storing
+// a new value. The notify side is a fence and a load unless somebody
+// has already gone to sleep in the kernel.
+struct WaitWord {
+private:
+    // UMWAIT wakes up on any store to the monitored line, so the word
+    // only shares it with mode, which is never written after construction.
+    // sleepers gets its own line, it's bumped by every thread going
+    // to sleep and would otherwise cut everybody's UMWAIT short.
+    alignas(64) std::atomic<uint32_t> word;
+    WaitMode mode;
+    alignas(64) std::atomic<uint32_t> sleepers;
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+		  "futex needs a plain 32-bit word");
+
+    static inline bool tsc_expired(uint64_t deadline) {
+	return (static_cast<int64_t>(__rdtsc() - deadline) >= 0);
+    }
+
+    // UMONITOR and UMWAIT are emitted directly, so callers don't need
+    // to build with -mwaitpkg. ECX = 1 selects C0.1, which is the
+    // faster one to wake up from.
+    static inline void umonitor(const volatile void *addr) {
+	__asm__ volatile ("umonitor %0" : : "r"(addr) : "memory");
+    }
+
+    static inline void umwait(uint64_t deadline) {
+	unsigned int lo = static_cast<unsigned int>(deadline);
+	unsigned int hi = static_cast<unsigned int>(deadline >> 32);
+
+	__asm__ volatile ("umwait %%ecx"
+			  : : "c"(1), "a"(lo), "d"(hi) : "memory", "cc");
+    }
+
+    bool spin_umwait(uint32_t old) const {
+	const uint64_t deadline = __rdtsc() + WaitCalibration::UMWAIT_BUDGET;
+
+	while (!tsc_expired(deadline)) {
+	    umonitor(&word);
+	    // Recheck after arming the monitor, otherwise a store
+	    // between the load and UMONITOR would be missed.
+	    if (word.load(std::memory_order_acquire) != old)
+		return true;
+	    umwait(__rdtsc() + WaitCalibration::UMWAIT_SLICE);
+	    if (word.load(std::memory_order_acquire) != old)
+		return true;
+	}
+	return false;
+    }
+
+    bool spin_pause(uint32_t old) const {
+	const WaitCalibration &cal = WaitCalibration::get();
+	const uint64_t deadline = __rdtsc() + WaitCalibration::PAUSE_BUDGET;
+	unsigned int n = 1;
+
+	while (!tsc_expired(deadline)) {
+	    for (unsigned int i = 0; i < n; i++)
+		_mm_pause();
+	    if (word.load(std::memory_order_acquire) != old)
+		return true;
+	    if (n < cal.max_pauses)
+		n = (n * 2 < cal.max_pauses) ? n * 2 : cal.max_pauses;
+	}
+	return false;
+    }
+
+    void sleep(uint32_t old) {
+	sleepers.fetch_add(1, std::memory_order_seq_cst);
+	while (word.load(std::memory_order_seq_cst) == old) {
+	    // EAGAIN and EINTR just mean "look again".
+	    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+		    FUTEX_WAIT_PRIVATE, old, nullptr, nullptr, 0);
+	}
+	sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wake(int count) {
+	// Pairs with the seq_cst increment in sleep(): either we see the
+	// sleeper, or it sees the new value before going into the kernel.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleepers.load(std::memory_order_relaxed) == 0)
+	    return;
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+		FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+public:
+    explicit WaitWord(uint32_t value = 0, WaitMode mode = WaitMode::AUTO)
+	: word(value), mode(mode), sleepers(0) {
+	const WaitCalibration &cal = WaitCalibration::get();
+
+	if (this->mode == WaitMode::AUTO)
+	    this->mode = cal.has_waitpkg ? WaitMode::UMWAIT : WaitMode::PAUSE;
+	// Don't fault with #UD on CPUs without it.
+	if (this->mode == WaitMode::UMWAIT && !cal.has_waitpkg)
+	    this->mode = WaitMode::PAUSE;
+    }
+
+    WaitWord(const WaitWord &) = delete;
+    WaitWord &operator=(const WaitWord &) = delete;
+
+    inline WaitMode wait_mode() const {
+	return mode;
+    }
+
+    inline uint32_t load(std::memory_order order =
+			 std::memory_order_acquire) const {
+	return word.load(order);
+    }
+
+    inline void store(uint32_t value, std::memory_order order =
+		      std::memory_order_release) {
+	word.store(value, order);
+    }
+
+    inline uint32_t fetch_add(uint32_t value, std::memory_order order =
+			      std::memory_order_acq_rel) {
+	return word.fetch_add(value, order);
+    }
+
+    // Block while the word still holds old. May return spuriously
+    // late, but never while the word still equals old.
+    void wait(uint32_t old) {
+	if (word.load(std::memory_order_acquire) != old)
+	    return;
+
+	switch (mode) {
+	case WaitMode::UMWAIT:
+	    if (spin_umwait(old))
+		return;
+	    break;
+	case WaitMode::PAUSE:
+	    if (spin_pause(old))
+		return;
+	    break;
+	default:
+	    break;
+	}
+	sleep(old);
+    }
+
+    inline void notify_one() {
+	wake(1);
+    }
+
+    inline void notify_all() {
+	wake(INT32_MAX);
+    }
+};
+
+#endif